@@ -8,6 +8,14 @@
 #include <malloc.h>
 #include <memory.h>
 #include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <errno.h>
 
 /**********************************************************************
 *                               macros                               *
@@ -24,6 +32,10 @@
 #define MAX_V 0.3    // the max velocity for birf to drop down
 #define BAR_VX -0.2   // the velocity of barriers
 #define BAR_VY 0.1
+#define BAR_VY_MAX 0.2
+#define FAR_VX (BAR_VX * 0.25) // parallax velocity of the far layer
+#define MID_VX (BAR_VX * 0.5)  // parallax velocity of the middle layer
+#define NEAR_VX BAR_VX         // the near layer moves with barriers
 
 /**********************************************************************
 *                            Objects Size                            *
@@ -38,11 +50,42 @@
 #define OVER_H 7    // gameover window height
 #define START_W 65
 #define START_H 6
+#define TILE_W 156  // width of the scrolling background tiles
+#define FAR_Y 1     // first row of the far layer in valley
+#define FAR_H 13
+#define MID_Y 14
+#define MID_H 8
+#define NEAR_Y 22
+#define NEAR_H 7
 #define BAR_SEPH_MIN 10
 #define BAR_SEPH_MAX 30
 #define BAR_SEPV_MIN 10
 #define BAR_SEPV_MAX 20
 
+/**********************************************************************
+*                               Level                                *
+**********************************************************************/
+#define LEVEL_QUEUE 64 // size of the lookahead queue
+#define LEVEL_LOW 16   // refill the queue when less barriers left
+#define LEVEL_STEP 5   // the game gets harder every LEVEL_STEP barriers
+
+/**********************************************************************
+*                             Hot Reload                             *
+**********************************************************************/
+#define RELOAD_DIR "."     // directory of the watched assets
+#define RELOAD_BUFF 4096   // buffer size for inotify events
+
+/**********************************************************************
+*                               Store                                *
+**********************************************************************/
+#define STORE_FILE "DoveFly.dat" // high scores and session stats
+#define STORE_MAGIC 0x45564f44   // "DOVE"
+#define STORE_VERSION 2
+#define STORE_TOP 10       // length of leaderboard
+#define STORE_SESSIONS 64  // the oldest session is overwritten
+#define STORE_BUCKETS 32   // frame time histogram, 1ms per bucket
+#define RECORD_SIZE 256    // max size of data in a record
+
 /**********************************************************************
 *                               Objects                              *
 **********************************************************************/
@@ -92,10 +135,25 @@ typedef struct _Anime {
     int (*load_frames)(struct _Anime *this, char *file);
 } Anime;
 
+// a horizontal band of the window background, which scrolls over a
+// wide tile, p->w is the width of tile and w is the visible width
+typedef struct _Layer {
+    Role *p;
+    int w;
+    float ox; // current column offset in tile
+    float vx;
+    struct _Layer *next;
+    void (*scroll_layer)(struct _Layer *this);
+} Layer;
+
 typedef struct _Window {
     Role *p;
     char *pixel;
+    char *shown; // pixel that have been synced to screen
+    Layer *layers; // sorted by row, must not overlap
+    void (*add_layer)(struct _Window *this, Layer *layer);
     void (*draw_self)(struct _Window *this);
+    void (*draw_layer)(struct _Window *this, Layer *layer);
     void (*draw_role)(struct _Window *this, Role *role);
     void (*draw_string)(struct _Window *this, int sx, int sy, char *s);
     void (*sync_screen)(struct _Window *this);
@@ -106,6 +164,29 @@ typedef struct {
     float v;
 } Bird;
 
+// parameters of a barrier, generated by level ahead of time
+typedef struct {
+    int dx;  // distance from the right border of window
+    int sep;
+    int y;
+    float vy;
+} BarrierSpec;
+
+typedef struct _Level {
+    int fixed;          // 0 for a random level in every game
+    unsigned int seed;
+    unsigned int state; // random state
+    unsigned int n;     // number of barriers generated
+    int h;              // height of window
+    BarrierSpec queue[LEVEL_QUEUE];
+    unsigned int head;  // pop from head and push to tail
+    unsigned int tail;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    void (*fill_level)(struct _Level *this);
+    void (*next_barrier)(struct _Level *this, BarrierSpec *spec);
+} Level;
+
 typedef struct _Barrier {
     Role *p;
     int sep;
@@ -118,94 +199,233 @@ typedef struct _BarrierManager {
     Barrier *head;
     Barrier **tail;
     Barrier *pool;
+    Role *proto; // parsed barrier skin, new barriers are cloned from it
+    Level *level;
     void (*check_barrier)(struct _BarrierManager *this, Window *win, Score *score);
     void (*add_barrier)(struct _BarrierManager *this, Window *win);
     void (*del_barrier)(struct _BarrierManager *this);
 } BarrierManager;
 
+// an asset file of fn frames of w * h, it is parsed by the reload thread
+// and applied to target by the frame loop between frames
+typedef struct _Asset {
+    char *file;
+    int w;
+    int h;
+    int fn;
+    void *target;
+    char *pending; // parsed skin waiting to be applied, guarded by lock
+    struct _Asset *next;
+    void (*apply)(struct _Asset *this, char *skin);
+} Asset;
+
+typedef struct _Reloader {
+    int fd; // inotify instance, -1 if not available
+    Asset *assets;
+    pthread_mutex_t lock;
+    Asset *(*watch_asset)(struct _Reloader *this, char *file, int w, int h, int fn, void *target, void (*apply)(Asset *this, char *skin));
+    void (*reload_assets)(struct _Reloader *this);
+} Reloader;
+
+// records of store file use fixed width fields with explicit padding,
+// so that the layout is the same on every ABI
+typedef struct {
+    uint32_t score;
+    uint32_t dist; // in 0.1m
+    uint32_t seed;
+    uint32_t pad;
+    int64_t time;
+} HighScore;
+
+typedef struct {
+    uint32_t id;     // 0 for an unused session
+    uint32_t games;
+    uint32_t best;
+    uint32_t dist;   // in 0.1m
+    int64_t start;
+    uint64_t frames;
+    uint64_t frame_us; // sum of frame time
+    uint32_t max_us;
+    uint32_t pad;
+    uint32_t hist[STORE_BUCKETS];
+} Session;
+
+// a record has two slots, a commit writes the older one and the newer
+// valid slot is read, so a crash during commit keeps the last data
+typedef struct {
+    uint32_t seq;
+    uint32_t sum; // checksum of seq and data
+    char data[RECORD_SIZE];
+} Slot;
+
+typedef struct {
+    Slot slot[2];
+} Record;
+
+// the fixed layout of store file
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t top_n;
+    uint32_t sessions_n;
+    Record top;
+    Record sessions[STORE_SESSIONS];
+} StoreFile;
+
+_Static_assert(sizeof(HighScore) == 24 && offsetof(HighScore, time) == 16, "unexpected layout of HighScore");
+_Static_assert(sizeof(Session) == 176 && offsetof(Session, start) == 16 && offsetof(Session, hist) == 48, "unexpected layout of Session");
+_Static_assert(sizeof(Slot) == 8 + RECORD_SIZE && RECORD_SIZE % 8 == 0, "unexpected layout of Slot");
+_Static_assert(sizeof(StoreFile) == 16 + sizeof(Record) * (STORE_SESSIONS + 1), "unexpected layout of StoreFile");
+_Static_assert(sizeof(HighScore) * STORE_TOP <= RECORD_SIZE, "leaderboard does not fit in a record");
+_Static_assert(sizeof(Session) <= RECORD_SIZE, "session does not fit in a record");
+
+typedef struct _Store {
+    StoreFile *file; // mmaped, NULL if store is not available
+    int fd;
+    int readonly;
+    Session session; // current session, only in memory until committed
+    Record *record;  // record of current session
+    pthread_mutex_t lock;        // guards session
+    pthread_mutex_t commit_lock; // serializes commits of record
+    void (*record_frame)(struct _Store *this, uint32_t us);
+    void (*commit_session)(struct _Store *this);
+    void (*record_game)(struct _Store *this, Score *score, unsigned int seed, int quit);
+    void (*dump_stats)(struct _Store *this);
+} Store;
+
 typedef struct {
     Window *valley;
     Window *panel;
     Bird *bird;
     BarrierManager *barMgr;
     Score *score;
+    Reloader *reloader;
+    Store *store;
+    Role *gameover;
+    pthread_t draw_thread;
 } Args;
 
 /**********************************************************************
 *                        function declaration                        *
 **********************************************************************/
 // declarations for class methods
+void parse_skin(FILE *fp, char *skin, int w, int h);
 int load_skin(Role *this, char *file);
 int load_frames(Anime *this, char *file);
+void scroll_layer(Layer *this);
+void add_layer(Window *this, Layer *layer);
 void draw_self(Window *this);
+void draw_layer(Window *this, Layer *layer);
 void draw_role(Window *this, Role *role);
 void sync_screen(Window *this);
 void check_barrier(BarrierManager *this, Window *win, Score *score);
 void add_barrier(BarrierManager *this, Window *win);
 void del_barrier(BarrierManager *this);
+void fill_level(Level *this);
+void next_barrier(Level *this, BarrierSpec *spec);
+char *load_asset(Asset *this);
+void apply_role(Asset *this, char *skin);
+void apply_anime(Asset *this, char *skin);
+void apply_barriers(Asset *this, char *skin);
+Asset *watch_asset(Reloader *this, char *file, int w, int h, int fn, void *target, void (*apply)(Asset *this, char *skin));
+void reload_assets(Reloader *this);
+uint32_t checksum(uint32_t seq, void *data, size_t size);
+Slot *latest_slot(Record *record);
+void *read_record(Record *record);
+void commit_record(Record *record, void *data, size_t size);
+void record_frame(Store *this, uint32_t us);
+void commit_session(Store *this);
+void record_game(Store *this, Score *score, unsigned int seed, int quit);
+void dump_stats(Store *this);
 
 // declarations for create and destroy
 void setup_object(Object *obj, float x, float y, int w, int h);
 Anime *create_anime(float x, float y, int w, int h, int fn, int it, char *file);
 void destroy_anime(Anime **anime);
+Layer *create_layer(float x, float y, int w, int tw, int h, float vx, char *file);
+void destroy_layer(Layer **layer);
 Role *create_role(float x, float y, int w, int h, char *file);
+Role *clone_role(Role *role);
 void destroy_role(Role **role);
 Window *create_window(float x, float y, int w, int h, char *file);
 void destroy_window(Window **win);
 Bird *create_bird(float x, float y, int w, int h, char *file);
 void reset_bird(Bird *bird, float x, float y);
 void destroy_bird(Bird **bird);
-Barrier *create_barrier(float x, float y, int w, int h, float vx, float vy, char *file);
+Barrier *create_barrier(float x, float y, float vx, float vy, Role *proto);
 void destroy_barrier(Barrier **bar);
-BarrierManager *create_barrier_manager();
+Level *create_level(int h, int fixed, unsigned int seed);
+void reset_level(Level *level);
+void destroy_level(Level **level);
+BarrierManager *create_barrier_manager(Level *level);
 void reset_barrier_manager(BarrierManager *barMgr);
 void destroy_barrier_manager(BarrierManager **barMgr);
 Score *create_score();
 void reset_score(Score *score);
 void destroy_score(Score **score);
-
-// generate a random int in range of [start, end)
-int randint(int start, int end);
+Reloader *create_reloader(char *dir);
+void destroy_reloader(Reloader **reloader);
+Store *create_store(char *file, int readonly);
+void destroy_store(Store **store);
+
+// generate a random int in range of [start, end) with random state
+int randint(unsigned int *state, int start, int end);
+// hash a level name to seed
+unsigned int hash_seed(char *name);
 void init_game();
-void new_game(Window *valley, Window *panel, Role *start, BarrierManager *barMgr, Bird *bird, Score *score, Args *args);
+void exit_game();
+int new_game(Window *valley, Window *panel, Role *start, BarrierManager *barMgr, Bird *bird, Score *score, Args *args);
 void update_bird(Bird *bird);
 void update_barriers(Window *win, BarrierManager *barMgr, Score *score);
+void update_layers(Window *win);
 int collision_detect(Window *win, Bird *bird, BarrierManager *barMgr);
-void loop(Bird *bird, Score *score);
+int loop(Bird *bird, Score *score);
 void *play(void *_args);
 void *count(void *_args);
+void *generate(void *_args);
+void unlock_level(void *lock);
+void *reload(void *_args);
 
 /**********************************************************************
 *                      Objects Implementations                       *
 **********************************************************************/
 // role
-int load_skin(Role *this, char *file)
+// read h lines of w characters into skin, the short or missing lines
+// are padded with space, all the skin files are parsed by this
+void parse_skin(FILE *fp, char *skin, int w, int h)
 {
     // allocate some memory for buffer, the size of buffer must be more
     // than (w + 2), one byte for '\n', one byte for '\0'
-    char * buff = (char *) malloc((this->w + 2) * sizeof(char));
+    char *buff = (char *) malloc((w + 2) * sizeof(char));
+
+    memset(skin, ' ', sizeof(char) * w * h);
+    for (int y = 0; y < h; y++) {
+        if (fgets(buff, w + 2, fp) == NULL)
+            break;
+        for (int x = 0; x < w && buff[x] != '\n' && buff[x] != 0; x++) {
+            skin[y * w + x] = buff[x];
+        }
+    }
+
+    free(buff);
+}
+
+int load_skin(Role *this, char *file)
+{
     FILE *fp = fopen(file, "r");
     if (fp == NULL) {
         perror(file);
         return 0;
     }
 
-    for (int y = 0; y < this->h; y++) {
-        fgets(buff, this->w + 2, fp);
-        for (int x = 0; x < this->w; x++) {
-            this->skin[y * this->w + x] = buff[x];
-        }
-        if (feof(fp)) break;
-    }
+    parse_skin(fp, this->skin, this->w, this->h);
 
-    free(buff);
     fclose(fp);
     return 1;
 }
 
 int load_frames(Anime *this, char *file)
 {
-    char *buff = (char *) malloc((this->w + 2) * sizeof(char));
     FILE *fp = fopen(file, "r");
     if (fp == NULL) {
         perror(file);
@@ -213,28 +433,62 @@ int load_frames(Anime *this, char *file)
     }
 
     for (int f = 0; f < this->fn; f++) {
-        for (int y = 0; y < this->h; y++) {
-            fgets(buff, this->w + 2, fp);
-            for (int x = 0; x < this->w; x++) {
-                this->frames[f][y * this->w + x] = buff[x];
-            }
-            if (feof(fp)) break;
-        }
+        parse_skin(fp, this->frames[f], this->w, this->h);
     }
 
-    free(buff);
     fclose(fp);
     return 1;
 }
 
+// Layer
+void scroll_layer(Layer *this)
+{
+    this->ox -= this->vx;
+    while (this->ox >= this->p->w)
+        this->ox -= this->p->w;
+    while (this->ox < 0)
+        this->ox += this->p->w;
+}
+
 // Window
+void add_layer(Window *this, Layer *layer)
+{
+    Layer **next = &this->layers;
+    while (*next && (*next)->p->y < layer->p->y)
+        next = &(*next)->next;
+    layer->next = *next;
+    *next = layer;
+}
+
 void draw_self(Window *this)
 {
-    for (int x = 0; x < this->p->w; x++) {
-        for (int y = 0; y < this->p->h; y++) {
-            int index = y * this->p->w + x;
-            this->pixel[index] = this->p->skin[index];
-        }
+    // copy the static rows between layers, the rows covered by layers
+    // are read from their tiles directly
+    int w = this->p->w;
+    int y = 0;
+    for (Layer *layer = this->layers; layer; layer = layer->next) {
+        memcpy(this->pixel + y * w, this->p->skin + y * w, ((int) layer->p->y - y) * w);
+        this->draw_layer(this, layer);
+        y = layer->p->y + layer->p->h;
+    }
+    memcpy(this->pixel + y * w, this->p->skin + y * w, (this->p->h - y) * w);
+}
+
+void draw_layer(Window *this, Layer *layer)
+{
+    int w = this->p->w;
+    int lx = layer->p->x;
+    int ox = layer->ox;
+    // the tile wraps at ox, so a row is made of two spans
+    int head = MIN(layer->w, layer->p->w - ox);
+    for (int y = 0; y < layer->p->h; y++) {
+        char *dst = this->pixel + ((int) layer->p->y + y) * w;
+        char *src = this->p->skin + ((int) layer->p->y + y) * w;
+        char *row = layer->p->skin + y * layer->p->w;
+        memcpy(dst, src, lx);
+        memcpy(dst + lx, row + ox, head);
+        memcpy(dst + lx + head, row, layer->w - head);
+        memcpy(dst + lx + layer->w, src + lx + layer->w, w - lx - layer->w);
     }
 }
 
@@ -268,10 +522,15 @@ void draw_string(struct _Window *this, int sx, int sy, char *s)
 
 void sync_screen(Window *this)
 {
-    for (int x = 0; x < this->p->w; x++) {
-        for (int y = 0; y < this->p->h; y++) {
+    // only send the pixel changed since last sync
+    for (int y = 0; y < this->p->h; y++) {
+        for (int x = 0; x < this->p->w; x++) {
+            int index = y * this->p->w + x;
+            if (this->pixel[index] == this->shown[index])
+                continue;
             move(this->p->y + y, this->p->x + x);
-            addch(this->pixel[y * this->p->w + x]);
+            addch(this->pixel[index]);
+            this->shown[index] = this->pixel[index];
         }
     }
     refresh();
@@ -301,15 +560,17 @@ void add_barrier(BarrierManager *this, Window *win)
         this->pool = this->pool->next;
     }
     else{
-        barrier = create_barrier(BAR_SEPH_MIN, BAR_SEPV_MAX, BAR_W, BAR_H, BAR_VX, BAR_VY, "barrier.ascii");
+        // never read the file here, add_barrier runs in the frame loop
+        barrier = create_barrier(BAR_SEPH_MIN, BAR_SEPV_MAX, BAR_VX, BAR_VY, this->proto);
     }
 
-    barrier->p->x = win->p->w + randint(BAR_SEPH_MIN, BAR_SEPH_MAX);
-    int sep = randint(BAR_SEPV_MIN, BAR_SEPV_MAX);
-    barrier->sep = sep;
-    barrier->p->y = randint(sep, win->p->h);
+    BarrierSpec spec;
+    this->level->next_barrier(this->level, &spec);
+    barrier->p->x = win->p->w + spec.dx;
+    barrier->sep = spec.sep;
+    barrier->p->y = spec.y;
     barrier->vx = BAR_VX;
-    barrier->vy = BAR_VY;
+    barrier->vy = spec.vy;
     barrier->next = NULL;
 
     if (*this->tail) {
@@ -336,6 +597,288 @@ void del_barrier(BarrierManager *this)
     this->pool = barrier;
 }
 
+// Level
+void fill_level(Level *this)
+{
+    // must be called with lock held
+    while (this->tail - this->head < LEVEL_QUEUE) {
+        BarrierSpec *spec = &this->queue[this->tail % LEVEL_QUEUE];
+        // spacing and gap narrow with the number of barriers, so that
+        // the same seed always generates the same course
+        int step = this->n / LEVEL_STEP;
+        spec->dx = randint(&this->state, BAR_SEPH_MIN, MAX(BAR_SEPH_MIN + 1, BAR_SEPH_MAX - step));
+        spec->sep = randint(&this->state, BAR_SEPV_MIN, MAX(BAR_SEPV_MIN + 1, BAR_SEPV_MAX - step));
+        spec->y = randint(&this->state, spec->sep, this->h);
+        spec->vy = MIN(BAR_VY_MAX, BAR_VY + step * 0.01);
+        this->n++;
+        this->tail++;
+    }
+}
+
+void next_barrier(Level *this, BarrierSpec *spec)
+{
+    pthread_mutex_lock(&this->lock);
+    // the generator is late, fill the queue by ourselves
+    if (this->head == this->tail)
+        this->fill_level(this);
+    *spec = this->queue[this->head % LEVEL_QUEUE];
+    this->head++;
+    if (this->tail - this->head < LEVEL_LOW)
+        pthread_cond_signal(&this->cond);
+    pthread_mutex_unlock(&this->lock);
+}
+
+// Asset
+char *load_asset(Asset *this)
+{
+    FILE *fp = fopen(this->file, "r");
+    if (fp == NULL) {
+        perror(this->file);
+        return NULL;
+    }
+
+    char *skin = (char *) malloc(sizeof(char) * this->w * this->h * this->fn);
+    for (int f = 0; f < this->fn; f++) {
+        parse_skin(fp, skin + f * this->w * this->h, this->w, this->h);
+    }
+
+    fclose(fp);
+    return skin;
+}
+
+void apply_role(Asset *this, char *skin)
+{
+    Role *role = (Role *) this->target;
+    memcpy(role->skin, skin, this->w * this->h);
+}
+
+void apply_anime(Asset *this, char *skin)
+{
+    Anime *anime = (Anime *) this->target;
+    for (int f = 0; f < anime->fn; f++) {
+        memcpy(anime->frames[f], skin + f * this->w * this->h, this->w * this->h);
+    }
+}
+
+void apply_barriers(Asset *this, char *skin)
+{
+    // every barrier has its own skin, both active and pooled ones, and
+    // the prototype for barriers created later
+    BarrierManager *barMgr = (BarrierManager *) this->target;
+    memcpy(barMgr->proto->skin, skin, this->w * this->h);
+    for (Barrier *barrier = barMgr->head; barrier; barrier = barrier->next)
+        memcpy(barrier->p->skin, skin, this->w * this->h);
+    for (Barrier *barrier = barMgr->pool; barrier; barrier = barrier->next)
+        memcpy(barrier->p->skin, skin, this->w * this->h);
+}
+
+// Reloader
+Asset *watch_asset(Reloader *this, char *file, int w, int h, int fn, void *target, void (*apply)(Asset *this, char *skin))
+{
+    Asset *asset = (Asset *) malloc(sizeof(Asset));
+
+    asset->file = file;
+    asset->w = w;
+    asset->h = h;
+    asset->fn = fn;
+    asset->target = target;
+    asset->pending = NULL;
+    asset->apply = apply;
+
+    pthread_mutex_lock(&this->lock);
+    asset->next = this->assets;
+    this->assets = asset;
+    pthread_mutex_unlock(&this->lock);
+
+    return asset;
+}
+
+void reload_assets(Reloader *this)
+{
+    // called between frames, never wait for the reload thread, the
+    // pending skins will be applied in the next frame
+    if (pthread_mutex_trylock(&this->lock) != 0)
+        return;
+    for (Asset *asset = this->assets; asset; asset = asset->next) {
+        if (asset->pending == NULL)
+            continue;
+        asset->apply(asset, asset->pending);
+        free(asset->pending);
+        asset->pending = NULL;
+    }
+    pthread_mutex_unlock(&this->lock);
+}
+
+// Store
+uint32_t checksum(uint32_t seq, void *data, size_t size)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u ^ seq;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= ((unsigned char *) data)[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+Slot *latest_slot(Record *record)
+{
+    Slot *latest = NULL;
+    for (int i = 0; i < 2; i++) {
+        Slot *slot = &record->slot[i];
+        if (slot->seq == 0 || slot->sum != checksum(slot->seq, slot->data, RECORD_SIZE))
+            continue;
+        if (latest == NULL || slot->seq > latest->seq)
+            latest = slot;
+    }
+    return latest;
+}
+
+void *read_record(Record *record)
+{
+    Slot *latest = latest_slot(record);
+    return latest? latest->data: NULL;
+}
+
+void commit_record(Record *record, void *data, size_t size)
+{
+    // write the slot which is not the latest valid one, a torn write
+    // only breaks the checksum of that slot
+    Slot *latest = latest_slot(record);
+    Slot *slot = latest == &record->slot[0]? &record->slot[1]: &record->slot[0];
+    uint32_t seq = latest? latest->seq + 1: 1;
+
+    memcpy(slot->data, data, size);
+    memset(slot->data + size, 0, RECORD_SIZE - size);
+    slot->sum = checksum(seq, slot->data, RECORD_SIZE);
+    slot->seq = seq;
+}
+
+void record_frame(Store *this, uint32_t us)
+{
+    // called on frame path, the mapping is never touched here, since a
+    // write to a page under writeback may fault and wait for it
+    if (this->file == NULL || this->readonly)
+        return;
+    pthread_mutex_lock(&this->lock);
+    this->session.frames++;
+    this->session.frame_us += us;
+    this->session.max_us = MAX(this->session.max_us, us);
+    this->session.hist[MIN(us / 1000, STORE_BUCKETS - 1)]++;
+    pthread_mutex_unlock(&this->lock);
+}
+
+// copy session to the mapping, called by count thread every second and
+// at the end of game, never on frame path
+void commit_session(Store *this)
+{
+    if (this->file == NULL || this->readonly)
+        return;
+    Session session;
+    pthread_mutex_lock(&this->lock);
+    session = this->session;
+    pthread_mutex_unlock(&this->lock);
+
+    pthread_mutex_lock(&this->commit_lock);
+    commit_record(this->record, &session, sizeof(Session));
+    pthread_mutex_unlock(&this->commit_lock);
+}
+
+// a game quit by player is not counted, only its frames are kept
+void record_game(Store *this, Score *score, unsigned int seed, int quit)
+{
+    if (this->file == NULL || this->readonly)
+        return;
+    if (!quit) {
+        pthread_mutex_lock(&this->lock);
+        this->session.games++;
+        this->session.best = MAX(this->session.best, score->score);
+        this->session.dist += score->dist * 10;
+        pthread_mutex_unlock(&this->lock);
+    }
+    this->commit_session(this);
+    if (quit || score->score == 0)
+        return;
+
+    HighScore top[STORE_TOP];
+    HighScore *old = (HighScore *) read_record(&this->file->top);
+    if (old)
+        memcpy(top, old, sizeof(top));
+    else
+        memset(top, 0, sizeof(top));
+
+    // insert into the sorted leaderboard
+    int i = STORE_TOP;
+    while (i > 0 && (top[i - 1].time == 0 || top[i - 1].score < score->score))
+        i--;
+    if (i == STORE_TOP)
+        return;
+    memmove(&top[i + 1], &top[i], (STORE_TOP - i - 1) * sizeof(HighScore));
+    top[i].score = score->score;
+    top[i].dist = score->dist * 10;
+    top[i].pad = 0;
+    top[i].seed = seed;
+    top[i].time = time(0);
+    commit_record(&this->file->top, top, sizeof(top));
+}
+
+void dump_stats(Store *this)
+{
+    if (this->file == NULL)
+        return;
+
+    printf("High Scores\n");
+    printf("%4s %8s %12s %12s  %s\n", "#", "Score", "Distance", "Seed", "Date");
+    HighScore *top = (HighScore *) read_record(&this->file->top);
+    for (int i = 0; top && i < STORE_TOP && top[i].time; i++) {
+        char date[32];
+        time_t t = top[i].time;
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&t));
+        printf("%4d %8u %11.1fm %12u  %s\n", i + 1, top[i].score, top[i].dist / 10.0, top[i].seed, date);
+    }
+
+    // aggregate all sessions
+    Session total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < STORE_SESSIONS; i++) {
+        Session *session = (Session *) read_record(&this->file->sessions[i]);
+        if (session == NULL || session->id == 0)
+            continue;
+        total.id++;
+        total.games += session->games;
+        total.best = MAX(total.best, session->best);
+        total.dist += session->dist;
+        total.frames += session->frames;
+        total.frame_us += session->frame_us;
+        total.max_us = MAX(total.max_us, session->max_us);
+        for (int b = 0; b < STORE_BUCKETS; b++)
+            total.hist[b] += session->hist[b];
+    }
+
+    printf("\nSessions\n");
+    printf("sessions:   %u\n", total.id);
+    printf("games:      %u\n", total.games);
+    printf("best score: %u\n", total.best);
+    printf("distance:   %.1fm\n", total.dist / 10.0);
+    printf("frames:     %llu\n", (unsigned long long) total.frames);
+    if (total.frames == 0)
+        return;
+    printf("frame time: avg %.2fms, max %.2fms\n", total.frame_us / 1000.0 / total.frames, total.max_us / 1000.0);
+
+    // percentiles are the upper bound of histogram buckets
+    int p[] = {50, 90, 99};
+    uint64_t seen = 0;
+    int b = 0;
+    for (int i = 0; i < sizeof(p) / sizeof(p[0]); i++) {
+        while (b < STORE_BUCKETS && (seen + total.hist[b]) * 100 < total.frames * p[i])
+            seen += total.hist[b++];
+        if (b >= STORE_BUCKETS - 1)
+            printf("p%d:        >= %dms\n", p[i], STORE_BUCKETS - 1);
+        else
+            printf("p%d:        < %dms\n", p[i], b + 1);
+    }
+}
+
 
 /**********************************************************************
 *                          global variables                          *
@@ -387,6 +930,28 @@ void destroy_anime(Anime **anime)
     *anime = NULL;
 }
 
+Layer *create_layer(float x, float y, int w, int tw, int h, float vx, char *file)
+{
+    Layer *layer = (Layer *) malloc(sizeof(Layer));
+
+    layer->p = create_role(x, y, tw, h, file);
+    layer->w = w;
+    layer->ox = 0;
+    layer->vx = vx;
+    layer->next = NULL;
+    layer->scroll_layer = scroll_layer;
+
+    return layer;
+}
+
+void destroy_layer(Layer **layer)
+{
+    destroy_role(&(*layer)->p);
+
+    free(*layer);
+    *layer = NULL;
+}
+
 Role *create_role(float x, float y, int w, int h, char *file)
 {
     Role *role = (Role *) malloc(sizeof(Role));
@@ -401,6 +966,20 @@ Role *create_role(float x, float y, int w, int h, char *file)
     return role;
 }
 
+Role *clone_role(Role *role)
+{
+    Role *clone = (Role *) malloc(sizeof(Role));
+
+    setup_object((Object *) clone, role->x, role->y, role->w, role->h);
+    clone->load_skin = load_skin;
+
+    char *skin = (char *) malloc(sizeof(char) * role->w * role->h);
+    memcpy(skin, role->skin, sizeof(char) * role->w * role->h);
+    clone->skin = skin;
+
+    return clone;
+}
+
 void destroy_role(Role **role)
 {
     free((*role)->skin);
@@ -413,9 +992,15 @@ Window *create_window(float x, float y, int w, int h, char *file)
     Window *win = (Window *) malloc(sizeof(Window));
 
     char *pixel = (char *) malloc(sizeof(char) * w * h);
+    char *shown = (char *) malloc(sizeof(char) * w * h);
+    memset(shown, 0, sizeof(char) * w * h);
     win->p = create_role(x, y, w, h, file);
     win->pixel = pixel;
+    win->shown = shown;
+    win->layers = NULL;
+    win->add_layer = add_layer;
     win->draw_self = draw_self;
+    win->draw_layer = draw_layer;
     win->draw_role = draw_role;
     win->draw_string = draw_string;
     win->sync_screen = sync_screen;
@@ -427,7 +1012,14 @@ void destroy_window(Window **win)
 {
     destroy_role(&(*win)->p);
 
+    Layer *layer;
+    while ((*win)->layers) {
+        layer = (*win)->layers;
+        (*win)->layers = (*win)->layers->next;
+        destroy_layer(&layer);
+    }
     free((*win)->pixel);
+    free((*win)->shown);
     free(*win);
     *win = NULL;
 }
@@ -457,11 +1049,13 @@ void destroy_bird(Bird **bird)
     *bird = NULL;
 }
 
-Barrier *create_barrier(float x, float y, int w, int h, float vx, float vy, char *file)
+Barrier *create_barrier(float x, float y, float vx, float vy, Role *proto)
 {
     Barrier *bar = (Barrier *) malloc(sizeof(Barrier));
 
-    bar->p = create_role(x, y, w, h, file);
+    bar->p = clone_role(proto);
+    bar->p->x = x;
+    bar->p->y = y;
     bar->vx = vx;
     bar->vy = vy;
     bar->next = NULL;
@@ -477,13 +1071,52 @@ void destroy_barrier(Barrier **bar)
     *bar = NULL;
 }
 
-BarrierManager *create_barrier_manager()
+Level *create_level(int h, int fixed, unsigned int seed)
+{
+    Level *level = (Level *) malloc(sizeof(Level));
+
+    level->fixed = fixed;
+    level->seed = seed;
+    level->h = h;
+    level->fill_level = fill_level;
+    level->next_barrier = next_barrier;
+    pthread_mutex_init(&level->lock, NULL);
+    pthread_cond_init(&level->cond, NULL);
+    reset_level(level);
+
+    return level;
+}
+
+void reset_level(Level *level)
+{
+    pthread_mutex_lock(&level->lock);
+    if (!level->fixed)
+        level->seed = rand();
+    level->state = level->seed;
+    level->n = 0;
+    level->head = 0;
+    level->tail = 0;
+    level->fill_level(level);
+    pthread_mutex_unlock(&level->lock);
+}
+
+void destroy_level(Level **level)
+{
+    pthread_mutex_destroy(&(*level)->lock);
+    pthread_cond_destroy(&(*level)->cond);
+    free(*level);
+    *level = NULL;
+}
+
+BarrierManager *create_barrier_manager(Level *level)
 {
     BarrierManager * barMgr = (BarrierManager *) malloc(sizeof(BarrierManager));
 
     barMgr->head = NULL;
     barMgr->tail = &barMgr->head;
     barMgr->pool = NULL;
+    barMgr->proto = create_role(0, 0, BAR_W, BAR_H, "barrier.ascii");
+    barMgr->level = level;
 
     barMgr->check_barrier = check_barrier;
     barMgr->add_barrier = add_barrier;
@@ -501,6 +1134,7 @@ void reset_barrier_manager(BarrierManager *barMgr)
     barMgr->pool = barMgr->head;
     barMgr->head = NULL;
     barMgr->tail = &barMgr->head;
+    reset_level(barMgr->level);
 }
 
 void destroy_barrier_manager(BarrierManager **barMgr)
@@ -516,6 +1150,7 @@ void destroy_barrier_manager(BarrierManager **barMgr)
         (*barMgr)->pool = (*barMgr)->pool->next;
         destroy_barrier(&barrier);
     }
+    destroy_role(&(*barMgr)->proto);
     free(*barMgr);
     *barMgr = NULL;
 }
@@ -544,16 +1179,155 @@ void destroy_score(Score **score)
     *score = NULL;
 }
 
+Reloader *create_reloader(char *dir)
+{
+    Reloader *reloader = (Reloader *) malloc(sizeof(Reloader));
+
+    reloader->assets = NULL;
+    reloader->watch_asset = watch_asset;
+    reloader->reload_assets = reload_assets;
+    pthread_mutex_init(&reloader->lock, NULL);
+
+    // editors either rewrite the file or rename a new one over it
+    reloader->fd = inotify_init();
+    if (reloader->fd >= 0 && inotify_add_watch(reloader->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(reloader->fd);
+        reloader->fd = -1;
+    }
+
+    return reloader;
+}
+
+void destroy_reloader(Reloader **reloader)
+{
+    Asset *asset;
+    while ((*reloader)->assets) {
+        asset = (*reloader)->assets;
+        (*reloader)->assets = (*reloader)->assets->next;
+        free(asset->pending);
+        free(asset);
+    }
+    if ((*reloader)->fd >= 0)
+        close((*reloader)->fd);
+    pthread_mutex_destroy(&(*reloader)->lock);
+    free(*reloader);
+    *reloader = NULL;
+}
+
+Store *create_store(char *file, int readonly)
+{
+    Store *store = (Store *) malloc(sizeof(Store));
+
+    store->file = NULL;
+    store->readonly = readonly;
+    store->record = NULL;
+    store->record_frame = record_frame;
+    store->commit_session = commit_session;
+    store->record_game = record_game;
+    store->dump_stats = dump_stats;
+    memset(&store->session, 0, sizeof(Session));
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_mutex_init(&store->commit_lock, NULL);
+
+    store->fd = open(file, readonly? O_RDONLY: O_RDWR | O_CREAT, 0644);
+    if (store->fd < 0) {
+        perror(file);
+        return store;
+    }
+    // only one instance writes the store, the others play without it,
+    // readers need no lock since torn records fail the checksum
+    if (!readonly && flock(store->fd, LOCK_EX | LOCK_NB) < 0) {
+        fprintf(stderr, "%s: used by another instance, scores are not saved\n", file);
+        close(store->fd);
+        store->fd = -1;
+        return store;
+    }
+
+    // a new file is extended to the fixed size, the pages are zero
+    struct stat st;
+    fstat(store->fd, &st);
+    if (st.st_size == 0 && !readonly && ftruncate(store->fd, sizeof(StoreFile)) == 0)
+        st.st_size = sizeof(StoreFile);
+    if (st.st_size != sizeof(StoreFile)) {
+        fprintf(stderr, "%s: unexpected size of store\n", file);
+        return store;
+    }
+
+    StoreFile *sf = (StoreFile *) mmap(NULL, sizeof(StoreFile), readonly? PROT_READ: PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+    if (sf == MAP_FAILED) {
+        perror(file);
+        return store;
+    }
+    if (sf->magic == 0 && !readonly) {
+        sf->magic = STORE_MAGIC;
+        sf->version = STORE_VERSION;
+        sf->top_n = STORE_TOP;
+        sf->sessions_n = STORE_SESSIONS;
+    }
+    if (sf->magic != STORE_MAGIC || sf->version != STORE_VERSION || sf->top_n != STORE_TOP || sf->sessions_n != STORE_SESSIONS) {
+        fprintf(stderr, "%s: incompatible store\n", file);
+        munmap(sf, sizeof(StoreFile));
+        return store;
+    }
+    store->file = sf;
+    if (readonly)
+        return store;
+
+    // take the place of an unused or the oldest session
+    uint32_t id = 0, oldest = 0, oldest_id = -1;
+    for (int i = 0; i < STORE_SESSIONS; i++) {
+        Session *session = (Session *) read_record(&sf->sessions[i]);
+        uint32_t sid = session? session->id: 0;
+        id = MAX(id, sid);
+        if (sid < oldest_id) {
+            oldest = i;
+            oldest_id = sid;
+        }
+    }
+    store->record = &sf->sessions[oldest];
+    store->session.id = id + 1;
+    store->session.start = time(0);
+    // take the record now, so that the next session does not pick it
+    commit_record(store->record, &store->session, sizeof(Session));
+
+    return store;
+}
+
+void destroy_store(Store **store)
+{
+    if ((*store)->file) {
+        (*store)->commit_session(*store);
+        if (!(*store)->readonly)
+            msync((*store)->file, sizeof(StoreFile), MS_SYNC);
+        munmap((*store)->file, sizeof(StoreFile));
+    }
+    if ((*store)->fd >= 0)
+        close((*store)->fd);
+    pthread_mutex_destroy(&(*store)->lock);
+    pthread_mutex_destroy(&(*store)->commit_lock);
+    free(*store);
+    *store = NULL;
+}
+
 
 /**********************************************************************
 *                             functions                              *
 **********************************************************************/
-int randint(int start, int end) {
+int randint(unsigned int *state, int start, int end) {
     if (start == end)
         return start;
     if (end > start)
-        return start + rand() % (end - start);
-    return randint(end, start);
+        return start + rand_r(state) % (end - start);
+    return randint(state, end, start);
+}
+
+unsigned int hash_seed(char *name)
+{
+    // djb2
+    unsigned int hash = 5381;
+    while (*name)
+        hash = hash * 33 + (unsigned char) *name++;
+    return hash;
 }
 
 void init_game()
@@ -564,16 +1338,22 @@ void init_game()
     noecho();
     curs_set(0);
 
-    // random seed
+    // random seed for levels without name
     srand(time(0));
 }
 
-void new_game(Window *valley, Window *panel, Role *start, BarrierManager *barMgr, Bird *bird, Score *score, Args *args)
+void exit_game()
+{
+    endwin();
+}
+
+int new_game(Window *valley, Window *panel, Role *start, BarrierManager *barMgr, Bird *bird, Score *score, Args *args)
 {
     // reset roles properties
     reset_score(score);
     reset_bird(bird, 20, 10);
     reset_barrier_manager(barMgr);
+    args->reloader->reload_assets(args->reloader);
 
     // draw background
     valley->draw_self(valley);
@@ -587,13 +1367,14 @@ void new_game(Window *valley, Window *panel, Role *start, BarrierManager *barMgr
     valley->sync_screen(valley);
     panel->sync_screen(panel);
 
-    while (getchar() != 0x20);
-
-    pthread_t draw_thread;
-    int ret = pthread_create(&draw_thread, NULL, &play, (void *)args);
+    int key;
+    while ((key = getchar()) != 0x20) {
+        if (key == 'q' || key == EOF)
+            return 0;
+    }
 
-    /* void *ret_val; */
-    /* pthread_join(draw_thread, &ret_val); */
+    pthread_create(&args->draw_thread, NULL, &play, (void *)args);
+    return 1;
 }
 
 void update_bird(Bird *bird)
@@ -624,6 +1405,12 @@ void update_barriers(Window *win, BarrierManager *barMgr, Score *score)
     }
 }
 
+void update_layers(Window *win)
+{
+    for (Layer *layer = win->layers; layer; layer = layer->next)
+        layer->scroll_layer(layer);
+}
+
 int collision_detect(Window *win, Bird *bird, BarrierManager *barMgr)
 {
     // collision detect between bird and borders
@@ -643,14 +1430,23 @@ int collision_detect(Window *win, Bird *bird, BarrierManager *barMgr)
     return 0;
 }
 
-void loop(Bird *bird, Score *score)
+// return 1 to play again, 0 to exit after game over, and -1 if the game
+// is quit while playing
+int loop(Bird *bird, Score *score)
 {
-    char key;
+    int key;
     while (1) {
         key = getchar();
+        if (key == 'q' || key == EOF) {
+            // the game is finished already if the bird is dead
+            int ret = score->over? 0: -1;
+            // stop the draw thread
+            score->over = 1;
+            return ret;
+        }
         if (key == 0x20) {
             if (score->over)
-                return;
+                return 1;
             else
                 bird->v = MIN_V;
         }
@@ -666,15 +1462,28 @@ void *play(void *_args)
     Bird *bird = args->bird;
     BarrierManager *barMgr = args->barMgr;
     Score *score = args->score;
+    Reloader *reloader = args->reloader;
+    Store *store = args->store;
 
+    struct timespec last, now;
+    clock_gettime(CLOCK_MONOTONIC, &last);
     while (1) {
+        // the game is quit
+        if (score->over)
+            return NULL;
+
+        // apply the assets changed on disk
+        reloader->reload_assets(reloader);
+
+        // frame time, clock_gettime goes through vdso without syscall
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        store->record_frame(store, (now.tv_sec - last.tv_sec) * 1000000 + (now.tv_nsec - last.tv_nsec) / 1000);
+        last = now;
+
         // collision detect
         if (collision_detect(valley, bird, barMgr)) {
             score->over = 1;
-            int x = (valley->p->w - OVER_W) >> 1;
-            int y = (valley->p->h - OVER_H) >> 1;
-            Role *gameover = create_role(x, y, OVER_W, OVER_H, "gameover.ascii");
-            valley->draw_role(valley, gameover);
+            valley->draw_role(valley, args->gameover);
             valley->sync_screen(valley);
             return NULL;
         }
@@ -682,6 +1491,7 @@ void *play(void *_args)
         // update roles in valley and draw it to screen
         update_bird(bird);
         update_barriers(valley, barMgr, score);
+        update_layers(valley);
         valley->draw_self(valley);
         valley->draw_role(valley, (Role *) bird->p);
         Barrier *barrier = barMgr->head;
@@ -701,13 +1511,15 @@ void *play(void *_args)
         // update panel
         panel->draw_self(panel);
 
-        char buff[20] = {0};
+        char buff[32] = {0};
         sprintf(buff, "Score:    %d", score->score);
         panel->draw_string(panel, 2, 4, buff);
         sprintf(buff, "Distance: %.1fm", score->dist);
         panel->draw_string(panel, 2, 5, buff);
         sprintf(buff, "FPS:      %d", score->fps);
         panel->draw_string(panel, 2, 6, buff);
+        sprintf(buff, "Seed:     %u", barMgr->level->seed);
+        panel->draw_string(panel, 2, 7, buff);
 
         panel->sync_screen(panel);
 
@@ -721,6 +1533,7 @@ void *count(void *_args)
     Args *args = (Args *) _args;
     Window *panel = args->panel;
     Score *score = args->score;
+    Store *store = args->store;
 
     unsigned int fn;
     char buff[20] = {0};
@@ -728,35 +1541,170 @@ void *count(void *_args)
         fn = score->fn;
         sleep(1);
         score->fps = score->fn - fn;;
+        store->commit_session(store);
         if (score->fn > 1000000)
             score->fn = 0;
     }
 }
 
-int main()
+// cleanup handler of generate thread
+void unlock_level(void *lock)
 {
+    pthread_mutex_unlock((pthread_mutex_t *) lock);
+}
+
+void *generate(void *_args)
+{
+    Level *level = (Level *) _args;
+
+    pthread_mutex_lock(&level->lock);
+    // the thread is canceled in pthread_cond_wait with lock held
+    pthread_cleanup_push(unlock_level, &level->lock);
+    while (1) {
+        while (level->tail - level->head >= LEVEL_LOW)
+            pthread_cond_wait(&level->cond, &level->lock);
+        level->fill_level(level);
+    }
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+void *reload(void *_args)
+{
+    Reloader *reloader = (Reloader *) _args;
+
+    // parse the changed file here, so that the frame loop never does
+    // file I/O
+    char buff[RELOAD_BUFF] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t len = read(reloader->fd, buff, sizeof(buff));
+        if (len < 0 && errno == EINTR)
+            continue;
+        // stop reloading, the game goes on with the loaded assets
+        if (len <= 0) {
+            perror("inotify");
+            return NULL;
+        }
+        for (char *ptr = buff; ptr < buff + len; ) {
+            struct inotify_event *event = (struct inotify_event *) ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0)
+                continue;
+            // assets are only added before this thread starts
+            for (Asset *asset = reloader->assets; asset; asset = asset->next) {
+                if (strcmp(asset->file, event->name) != 0)
+                    continue;
+                char *skin = load_asset(asset);
+                if (skin == NULL)
+                    continue;
+                pthread_mutex_lock(&reloader->lock);
+                free(asset->pending);
+                asset->pending = skin;
+                pthread_mutex_unlock(&reloader->lock);
+            }
+        }
+    }
+    return NULL;
+}
+
+// usage: DoveFly [level name], the same name always plays the same course
+//        DoveFly --seed N, replay the course of seed N shown on the panel
+//        DoveFly --stats, dump leaderboard and stats of all sessions
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "--stats") == 0) {
+        Store *store = create_store(STORE_FILE, 1);
+        store->dump_stats(store);
+        int ret = store->file? 0: 1;
+        destroy_store(&store);
+        return ret;
+    }
+
+    int fixed = 0;
+    unsigned int seed = 0;
+    if (argc > 1 && strcmp(argv[1], "--seed") == 0) {
+        char *end = NULL;
+        if (argc > 2)
+            seed = strtoul(argv[2], &end, 10);
+        if (end == NULL || end == argv[2] || *end != '\0') {
+            fprintf(stderr, "usage: %s --seed N\n", argv[0]);
+            return 1;
+        }
+        fixed = 1;
+    } else if (argc > 1) {
+        fixed = 1;
+        seed = hash_seed(argv[1]);
+    }
+
+    // open store before curses, so that its errors stay on the terminal
+    Store *store = create_store(STORE_FILE, 0);
     init_game();
 
     Window *valley = create_window(0, 0, VALLEY_W, VALLEY_H, "valley.ascii");
     Window *panel = create_window(0, VALLEY_H, PANEL_W, PANEL_H, "panel.ascii");
+    Reloader *reloader = create_reloader(RELOAD_DIR);
+    // parallax layers are optional, valley keeps static without them
+    struct { char *file; int y; int h; float vx; } layers[] = {
+        {"valley_far.ascii", FAR_Y, FAR_H, FAR_VX},
+        {"valley_mid.ascii", MID_Y, MID_H, MID_VX},
+        {"valley_near.ascii", NEAR_Y, NEAR_H, NEAR_VX},
+    };
+    for (int i = 0; i < sizeof(layers) / sizeof(layers[0]); i++) {
+        if (access(layers[i].file, R_OK) != 0)
+            continue;
+        Layer *layer = create_layer(1, layers[i].y, VALLEY_W - 2, TILE_W, layers[i].h, layers[i].vx, layers[i].file);
+        valley->add_layer(valley, layer);
+        reloader->watch_asset(reloader, layers[i].file, TILE_W, layers[i].h, 1, layer->p, apply_role);
+    }
     Role *start = create_role((VALLEY_W - START_W) >> 1, (VALLEY_H - START_H) >> 1, START_W, START_H, "start.ascii");
+    Role *gameover = create_role((VALLEY_W - OVER_W) >> 1, (VALLEY_H - OVER_H) >> 1, OVER_W, OVER_H, "gameover.ascii");
     Bird *bird = create_bird(20, 10, 3, 2, "bird.ascii");
-    BarrierManager *barMgr = create_barrier_manager();
+    Level *level = create_level(VALLEY_H, fixed, seed);
+    BarrierManager *barMgr = create_barrier_manager(level);
     Score *score = create_score();
-    Args args = {valley, panel, bird, barMgr, score};
+    Args args = {valley, panel, bird, barMgr, score, reloader, store, gameover};
+
+    reloader->watch_asset(reloader, "valley.ascii", VALLEY_W, VALLEY_H, 1, valley->p, apply_role);
+    reloader->watch_asset(reloader, "panel.ascii", PANEL_W, PANEL_H, 1, panel->p, apply_role);
+    reloader->watch_asset(reloader, "start.ascii", START_W, START_H, 1, start, apply_role);
+    reloader->watch_asset(reloader, "gameover.ascii", OVER_W, OVER_H, 1, gameover, apply_role);
+    reloader->watch_asset(reloader, "bird.ascii", bird->p->w, bird->p->h, bird->p->fn, bird->p, apply_anime);
+    reloader->watch_asset(reloader, "barrier.ascii", BAR_W, BAR_H, 1, barMgr, apply_barriers);
 
     pthread_t count_thread;
     pthread_create(&count_thread, NULL, &count, (void *)&args);
-    while (1) {
-        new_game(valley, panel, start, barMgr, bird, score, &args);
-        loop(bird, score);
+    pthread_t generate_thread;
+    pthread_create(&generate_thread, NULL, &generate, (void *)level);
+    pthread_t reload_thread;
+    if (reloader->fd >= 0)
+        pthread_create(&reload_thread, NULL, &reload, (void *)reloader);
+    while (new_game(valley, panel, start, barMgr, bird, score, &args)) {
+        int ret = loop(bird, score);
+        pthread_join(args.draw_thread, NULL);
+        store->record_game(store, score, level->seed, ret < 0);
+        if (ret <= 0)
+            break;
+    }
+    exit_game();
+
+    pthread_cancel(count_thread);
+    pthread_join(count_thread, NULL);
+    pthread_cancel(generate_thread);
+    pthread_join(generate_thread, NULL);
+    if (reloader->fd >= 0) {
+        pthread_cancel(reload_thread);
+        pthread_join(reload_thread, NULL);
     }
 
     destroy_window(&valley);
     destroy_window(&panel);
     destroy_role(&start);
+    destroy_role(&gameover);
     destroy_bird(&bird);
     destroy_barrier_manager(&barMgr);
+    destroy_level(&level);
+    destroy_reloader(&reloader);
+    destroy_store(&store);
     destroy_score(&score);
     return 0;
 }
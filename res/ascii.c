@@ -0,0 +1,545 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <png.h>
+#include <jpeglib.h>
+
+/**********************************************************************
+*                               macros                               *
+**********************************************************************/
+#define MAX(x,y) (((x)>(y))?(x):(y))
+#define MIN(x,y) (((x)<(y))?(x):(y))
+
+#define ALPHA_MIN 128 // cells less opaque than this are transparent
+#define BUFF_LEN 1024
+
+// characters to replace pixels, from dark to light
+static const char ascii_chars[] = "#;:\",`'. ";
+#define CHARS_N (sizeof(ascii_chars) - 1)
+
+// planes of the image, every plane is w * h bytes
+enum { GRAY, ALPHA, RED, GREEN, BLUE, PLANES };
+
+/**********************************************************************
+*                               Objects                              *
+**********************************************************************/
+typedef struct {
+    int w;
+    int h;
+    uint8_t *rgba; // w * h * 4
+} Image;
+
+// a sprite of w * h cells, all layers have the same layout as .ascii
+typedef struct {
+    int w;
+    int h;
+    char *ascii;
+    char *mask;  // '#' for opaque cells, ' ' for transparent ones
+    char *color; // curses color number of every cell, '0' - '7'
+} Sprite;
+
+// how a sprite is written, rows are cropped first, then mirrored, and
+// the border is drawn at last
+typedef struct {
+    int y0;     // keep rows in [y0, y1), y1 is 0 to keep all rows
+    int y1;
+    int mirror; // append the mirrored rows, which makes a seamless tile
+    int border; // draw a frame around, as the windows of game
+    int mask;   // also write output.mask
+    int color;  // also write output.color
+} Options;
+
+/**********************************************************************
+*                        function declaration                        *
+**********************************************************************/
+Image *load_image(char *file);
+Image *load_png(char *file);
+Image *load_jpeg(char *file);
+Image *load_ppm(char *file);
+void destroy_image(Image **img);
+Sprite *create_sprite(Image *img, int w, int h);
+int save_layer(char *layer, int w, int h, char *file);
+void destroy_sprite(Sprite **sprite);
+void grayscale(const uint8_t *restrict rgba, uint8_t *restrict planes, int n);
+void accumulate(const uint8_t *restrict row, uint32_t *restrict sum, int n);
+void quantize(const uint32_t *restrict sum, char *restrict out, int n, uint32_t area);
+int parse_option(Options *opt, char *token);
+void transform_layer(char *dst, char *src, int w, int h, Options *opt, const char *frame);
+int convert(Image *img, int w, int h, char *output, Options *opt);
+int batch(char *manifest, char **images, int n);
+
+/**********************************************************************
+*                               decoders                             *
+**********************************************************************/
+Image *load_image(char *file)
+{
+    unsigned char magic[8] = {0};
+    FILE *fp = fopen(file, "rb");
+    if (fp == NULL) {
+        perror(file);
+        return NULL;
+    }
+    size_t n = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+
+    if (n >= 8 && png_sig_cmp(magic, 0, 8) == 0)
+        return load_png(file);
+    if (n >= 3 && magic[0] == 0xff && magic[1] == 0xd8 && magic[2] == 0xff)
+        return load_jpeg(file);
+    if (n >= 2 && magic[0] == 'P' && magic[1] == '6')
+        return load_ppm(file);
+
+    fprintf(stderr, "%s: unsupported image format\n", file);
+    return NULL;
+}
+
+Image *load_png(char *file)
+{
+    png_image png;
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&png, file)) {
+        fprintf(stderr, "%s: %s\n", file, png.message);
+        return NULL;
+    }
+    png.format = PNG_FORMAT_RGBA;
+
+    Image *img = (Image *) malloc(sizeof(Image));
+    img->w = png.width;
+    img->h = png.height;
+    img->rgba = (uint8_t *) malloc(PNG_IMAGE_SIZE(png));
+    if (!png_image_finish_read(&png, NULL, img->rgba, 0, NULL)) {
+        fprintf(stderr, "%s: %s\n", file, png.message);
+        destroy_image(&img);
+        return NULL;
+    }
+    return img;
+}
+
+Image *load_jpeg(char *file)
+{
+    FILE *fp = fopen(file, "rb");
+    if (fp == NULL) {
+        perror(file);
+        return NULL;
+    }
+
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    Image *img = (Image *) malloc(sizeof(Image));
+    img->w = cinfo.output_width;
+    img->h = cinfo.output_height;
+    img->rgba = (uint8_t *) malloc(img->w * img->h * 4);
+
+    // decode rgb into the tail of every rgba row, then expand in place
+    while (cinfo.output_scanline < cinfo.output_height) {
+        uint8_t *row = img->rgba + cinfo.output_scanline * img->w * 4;
+        JSAMPROW rgb = row + img->w;
+        jpeg_read_scanlines(&cinfo, &rgb, 1);
+        for (int x = 0; x < img->w; x++) {
+            row[x * 4 + 0] = rgb[x * 3 + 0];
+            row[x * 4 + 1] = rgb[x * 3 + 1];
+            row[x * 4 + 2] = rgb[x * 3 + 2];
+            row[x * 4 + 3] = 0xff;
+        }
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
+    return img;
+}
+
+Image *load_ppm(char *file)
+{
+    FILE *fp = fopen(file, "rb");
+    if (fp == NULL) {
+        perror(file);
+        return NULL;
+    }
+
+    int w, h, maxval;
+    if (fscanf(fp, "P6 %d %d %d", &w, &h, &maxval) != 3 || maxval != 255 || w <= 0 || h <= 0) {
+        fprintf(stderr, "%s: only 8-bit binary ppm is supported\n", file);
+        fclose(fp);
+        return NULL;
+    }
+    // one whitespace between header and data
+    fgetc(fp);
+
+    Image *img = (Image *) malloc(sizeof(Image));
+    img->w = w;
+    img->h = h;
+    img->rgba = (uint8_t *) malloc(w * h * 4);
+    uint8_t *rgb = (uint8_t *) malloc(w * 3);
+    for (int y = 0; y < h; y++) {
+        uint8_t *row = img->rgba + y * w * 4;
+        if (fread(rgb, 3, w, fp) != (size_t) w) {
+            fprintf(stderr, "%s: unexpected end of file\n", file);
+            free(rgb);
+            fclose(fp);
+            destroy_image(&img);
+            return NULL;
+        }
+        for (int x = 0; x < w; x++) {
+            row[x * 4 + 0] = rgb[x * 3 + 0];
+            row[x * 4 + 1] = rgb[x * 3 + 1];
+            row[x * 4 + 2] = rgb[x * 3 + 2];
+            row[x * 4 + 3] = 0xff;
+        }
+    }
+
+    free(rgb);
+    fclose(fp);
+    return img;
+}
+
+void destroy_image(Image **img)
+{
+    free((*img)->rgba);
+    free(*img);
+    *img = NULL;
+}
+
+/**********************************************************************
+*                               kernels                              *
+**********************************************************************/
+// the per pixel loops are kept branchless over plain arrays, so that the
+// compiler is able to vectorize them
+
+// split rgba into planes, gray = (r + g + b) / 3, the division is done
+// by multiply and shift, which is exact for every sum not more than 765
+void grayscale(const uint8_t *restrict rgba, uint8_t *restrict planes, int n)
+{
+    for (int i = 0; i < n; i++) {
+        uint32_t sum = (uint32_t) rgba[i * 4] + rgba[i * 4 + 1] + rgba[i * 4 + 2];
+        planes[GRAY * n + i] = (sum * 43691) >> 17;
+        planes[ALPHA * n + i] = rgba[i * 4 + 3];
+        planes[RED * n + i] = rgba[i * 4 + 0];
+        planes[GREEN * n + i] = rgba[i * 4 + 1];
+        planes[BLUE * n + i] = rgba[i * 4 + 2];
+    }
+}
+
+// add a row of a plane to the column sums
+void accumulate(const uint8_t *restrict row, uint32_t *restrict sum, int n)
+{
+    for (int i = 0; i < n; i++) {
+        sum[i] += row[i];
+    }
+}
+
+// map the summed gray of every cell to the index of ascii_chars, the
+// division by area is replaced by a fixed point reciprocal
+void quantize(const uint32_t *restrict sum, char *restrict out, int n, uint32_t area)
+{
+    uint64_t recip = ((uint64_t) CHARS_N << 32) / (area * 256);
+    for (int i = 0; i < n; i++) {
+        uint32_t index = (sum[i] * recip) >> 32;
+        out[i] = MIN(index, CHARS_N - 1);
+    }
+}
+
+/**********************************************************************
+*                               Sprite                               *
+**********************************************************************/
+Sprite *create_sprite(Image *img, int w, int h)
+{
+    int n = img->w * img->h;
+    uint8_t *planes = (uint8_t *) malloc(n * PLANES);
+    grayscale(img->rgba, planes, n);
+
+    Sprite *sprite = (Sprite *) malloc(sizeof(Sprite));
+    sprite->w = w;
+    sprite->h = h;
+    sprite->ascii = (char *) malloc(w * h);
+    sprite->mask = (char *) malloc(w * h);
+    sprite->color = (char *) malloc(w * h);
+
+    // sums of every column of image, and of every cell of a sprite row
+    uint32_t *col = (uint32_t *) malloc(img->w * PLANES * sizeof(uint32_t));
+    uint32_t *cell = (uint32_t *) malloc(w * PLANES * sizeof(uint32_t));
+    char *index = (char *) malloc(w);
+
+    // every cell is the average of a box of pixels, a box has at least
+    // one pixel when the sprite is larger than the image
+    int *x0 = (int *) malloc((w + 1) * sizeof(int));
+    for (int x = 0; x <= w; x++)
+        x0[x] = (long) x * img->w / w;
+
+    for (int y = 0; y < h; y++) {
+        int y0 = (long) y * img->h / h;
+        int y1 = MAX(y0 + 1, (long) (y + 1) * img->h / h);
+
+        // sum the rows of the box vertically, this touches every pixel
+        // once and is done by the vectorized kernel
+        memset(col, 0, img->w * PLANES * sizeof(uint32_t));
+        for (int p = 0; p < PLANES; p++) {
+            for (int sy = y0; sy < y1; sy++)
+                accumulate(planes + p * n + sy * img->w, col + p * img->w, img->w);
+        }
+
+        // then sum the columns of every box, which is one pass of a row
+        uint32_t area = 0;
+        for (int x = 0; x < w; x++) {
+            int x1 = MAX(x0[x] + 1, x0[x + 1]);
+            uint32_t a = (x1 - x0[x]) * (y1 - y0);
+            if (x == 0)
+                area = a;
+            for (int p = 0; p < PLANES; p++) {
+                uint32_t sum = 0;
+                for (int sx = x0[x]; sx < x1; sx++)
+                    sum += col[p * img->w + sx];
+                // boxes of a row differ by one column at most, normalize
+                // the sums to the first box so that quantize can share
+                // one area
+                cell[p * w + x] = a == area? sum: (uint64_t) sum * area / a;
+            }
+        }
+
+        quantize(cell + GRAY * w, index, w, area);
+        for (int x = 0; x < w; x++) {
+            int i = y * w + x;
+            int opaque = cell[ALPHA * w + x] / area >= ALPHA_MIN;
+            sprite->ascii[i] = opaque? ascii_chars[(int) index[x]]: ' ';
+            sprite->mask[i] = opaque? '#': ' ';
+            // curses colors are ordered as bgr bits
+            int r = cell[RED * w + x] / area > 127;
+            int g = cell[GREEN * w + x] / area > 127;
+            int b = cell[BLUE * w + x] / area > 127;
+            sprite->color[i] = opaque? '0' + (r | g << 1 | b << 2): ' ';
+        }
+    }
+
+    free(x0);
+    free(index);
+    free(cell);
+    free(col);
+    free(planes);
+    return sprite;
+}
+
+int save_layer(char *layer, int w, int h, char *file)
+{
+    FILE *fp = file? fopen(file, "w"): stdout;
+    if (fp == NULL) {
+        perror(file);
+        return 0;
+    }
+
+    char *buff = (char *) malloc(w + 1);
+    for (int y = 0; y < h; y++) {
+        memcpy(buff, layer + y * w, w);
+        buff[w] = '\n';
+        fwrite(buff, 1, w + 1, fp);
+    }
+
+    free(buff);
+    if (file)
+        fclose(fp);
+    return 1;
+}
+
+void destroy_sprite(Sprite **sprite)
+{
+    free((*sprite)->ascii);
+    free((*sprite)->mask);
+    free((*sprite)->color);
+    free(*sprite);
+    *sprite = NULL;
+}
+
+/**********************************************************************
+*                             functions                              *
+**********************************************************************/
+// options are "rows=y0:y1", "mirror", "border", "mask" and "color"
+int parse_option(Options *opt, char *token)
+{
+    if (sscanf(token, "rows=%d:%d", &opt->y0, &opt->y1) == 2)
+        return opt->y0 >= 0 && opt->y1 > opt->y0;
+    if (strcmp(token, "mirror") == 0)
+        return opt->mirror = 1;
+    if (strcmp(token, "border") == 0)
+        return opt->border = 1;
+    if (strcmp(token, "mask") == 0)
+        return opt->mask = 1;
+    if (strcmp(token, "color") == 0)
+        return opt->color = 1;
+    return 0;
+}
+
+// frame is the corner, horizontal and vertical characters of border
+void transform_layer(char *dst, char *src, int w, int h, Options *opt, const char *frame)
+{
+    int b = opt->border;
+    int tw = opt->mirror? w * 2: w;
+    int ow = tw + b * 2;
+    int rows = opt->y1 - opt->y0;
+
+    for (int y = 0; y < rows; y++) {
+        char *row = dst + (y + b) * ow + b;
+        memcpy(row, src + (opt->y0 + y) * w, w);
+        for (int x = 0; opt->mirror && x < w; x++)
+            row[w + x] = row[w - 1 - x];
+        if (b) {
+            row[-1] = frame[2];
+            row[tw] = frame[2];
+        }
+    }
+    if (b) {
+        for (int y = 0; y < rows + 2; y += rows + 1) {
+            memset(dst + y * ow, frame[1], ow);
+            dst[y * ow] = frame[0];
+            dst[y * ow + ow - 1] = frame[0];
+        }
+    }
+}
+
+// write output.ascii, and output.mask or output.color if asked, or only
+// the ascii to stdout when output is NULL
+int convert(Image *img, int w, int h, char *output, Options *opt)
+{
+    if (w <= 0 || h <= 0) {
+        fprintf(stderr, "%s: invalid size %dx%d\n", output? output: "stdout", w, h);
+        return 0;
+    }
+    if (opt->y1 == 0)
+        opt->y1 = h;
+    if (opt->y1 > h) {
+        fprintf(stderr, "%s: rows %d:%d out of height %d\n", output? output: "stdout", opt->y0, opt->y1, h);
+        return 0;
+    }
+
+    Sprite *sprite = create_sprite(img, w, h);
+    int ow = (opt->mirror? w * 2: w) + opt->border * 2;
+    int oh = opt->y1 - opt->y0 + opt->border * 2;
+    char *layer = (char *) malloc(ow * oh);
+    char file[BUFF_LEN];
+    int ret = 1;
+
+    transform_layer(layer, sprite->ascii, w, h, opt, "+-|");
+    if (output == NULL) {
+        ret = save_layer(layer, ow, oh, NULL);
+    }
+    else {
+        snprintf(file, sizeof(file), "%s.ascii", output);
+        ret &= save_layer(layer, ow, oh, file);
+    }
+    if (output && opt->mask) {
+        transform_layer(layer, sprite->mask, w, h, opt, "###");
+        snprintf(file, sizeof(file), "%s.mask", output);
+        ret &= save_layer(layer, ow, oh, file);
+    }
+    if (output && opt->color) {
+        transform_layer(layer, sprite->color, w, h, opt, "777");
+        snprintf(file, sizeof(file), "%s.color", output);
+        ret &= save_layer(layer, ow, oh, file);
+    }
+
+    free(layer);
+    destroy_sprite(&sprite);
+    return ret;
+}
+
+// every line of manifest is "image width height output [options]",
+// paths are relative to the directory of manifest, '#' starts a
+// comment, only the lines of given images are converted if any
+int batch(char *manifest, char **images, int n)
+{
+    FILE *fp = fopen(manifest, "r");
+    if (fp == NULL) {
+        perror(manifest);
+        return 0;
+    }
+
+    char dir[BUFF_LEN] = {0};
+    char *slash = strrchr(manifest, '/');
+    if (slash)
+        snprintf(dir, sizeof(dir), "%.*s/", (int) (slash - manifest), manifest);
+
+    char line[BUFF_LEN], image[BUFF_LEN], output[BUFF_LEN], last[BUFF_LEN] = {0};
+    char ipath[BUFF_LEN * 2], opath[BUFF_LEN * 2];
+    Image *img = NULL;
+    int w, h, off, ret = 1;
+    while (fgets(line, sizeof(line), fp)) {
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+        if (sscanf(line, "%1023s %d %d %1023s%n", image, &w, &h, output, &off) != 4)
+            continue;
+
+        int wanted = n == 0;
+        for (int i = 0; i < n; i++)
+            wanted |= strcmp(images[i], image) == 0;
+        if (!wanted)
+            continue;
+
+        Options opt = {0};
+        int valid = 1;
+        for (char *token = strtok(line + off, " \t\n"); token; token = strtok(NULL, " \t\n")) {
+            if (!parse_option(&opt, token)) {
+                fprintf(stderr, "%s: invalid option %s\n", manifest, token);
+                valid = 0;
+            }
+        }
+        if (!valid) {
+            ret = 0;
+            continue;
+        }
+
+        // lines of the same image share the decoded image
+        if (img == NULL || strcmp(last, image) != 0) {
+            if (img)
+                destroy_image(&img);
+            snprintf(ipath, sizeof(ipath), "%s%s", dir, image);
+            img = load_image(ipath);
+            snprintf(last, sizeof(last), "%s", image);
+        }
+        if (img == NULL) {
+            ret = 0;
+            continue;
+        }
+        snprintf(opath, sizeof(opath), "%s%s", dir, output);
+        ret &= convert(img, w, h, opath, &opt);
+    }
+
+    if (img)
+        destroy_image(&img);
+    fclose(fp);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 3 && strcmp(argv[1], "-f") == 0)
+        return batch(argv[2], argv + 3, argc - 3)? 0: 1;
+
+    if (argc >= 4) {
+        Options opt = {0};
+        for (int i = 5; i < argc; i++) {
+            if (!parse_option(&opt, argv[i])) {
+                fprintf(stderr, "invalid option %s\n", argv[i]);
+                return 2;
+            }
+        }
+        Image *img = load_image(argv[1]);
+        if (img == NULL)
+            return 1;
+        int ret = convert(img, atoi(argv[2]), atoi(argv[3]), argc >= 5? argv[4]: NULL, &opt);
+        destroy_image(&img);
+        return ret? 0: 1;
+    }
+
+    fprintf(stderr, "usage: %s image width height [output [options]]\n", argv[0]);
+    fprintf(stderr, "       %s -f manifest [image ...]\n", argv[0]);
+    fprintf(stderr, "options: rows=y0:y1 mirror border mask color\n");
+    return 2;
+}